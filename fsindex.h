@@ -0,0 +1,111 @@
+
+// Whole-tree index format, shared by the filesystem and the mkindex tool.
+// It is a compact binary blob that describes every file and directory in
+// the tree, so the mount can serve all metadata out of one download.
+//
+// Layout (all integers are little endian):
+//   header:  "HFSINDX1" magic, u64 generation, u64 number of records
+//   records: u8 type (0 file, 1 dir), u64 size, i64 mtime,
+//            u16 path length, path bytes (absolute, no trailing slash)
+//
+// The generation is a hash of the record data, so it can be used as a
+// cheap validator (one ranged GET of the header) to detect changes.
+
+#ifndef __FS_INDEX_H__
+#define __FS_INDEX_H__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#define FSINDEX_MAGIC      "HFSINDX1"
+#define FSINDEX_HDR_SIZE   24
+
+class FSIndex {
+public:
+	class Record {
+	public:
+		std::string path;
+		bool isdir;
+		uint64_t size;
+		int64_t mtime;
+	};
+
+	static std::string serialize(const std::vector<Record> &records) {
+		std::string body;
+		for (const auto & r : records) {
+			body.push_back(r.isdir ? 1 : 0);
+			put(body, r.size, 8);
+			put(body, (uint64_t)r.mtime, 8);
+			put(body, r.path.size(), 2);
+			body += r.path;
+		}
+
+		std::string ret(FSINDEX_MAGIC);
+		put(ret, hash(body.data(), body.size()), 8);
+		put(ret, records.size(), 8);
+		return ret + body;
+	}
+
+	// Parses the header only (generation and record count)
+	static bool header(const std::string &data, uint64_t &generation, uint64_t &count) {
+		if (data.size() < FSINDEX_HDR_SIZE || memcmp(data.data(), FSINDEX_MAGIC, 8))
+			return false;
+		generation = get(data, 8, 8);
+		count = get(data, 16, 8);
+		return true;
+	}
+
+	static bool parse(const std::string &data, uint64_t &generation, std::vector<Record> &records) {
+		uint64_t count;
+		if (!header(data, generation, count))
+			return false;
+		if (hash(&data[FSINDEX_HDR_SIZE], data.size() - FSINDEX_HDR_SIZE) != generation)
+			return false;   // Truncated or corrupted
+
+		size_t p = FSINDEX_HDR_SIZE;
+		records.clear();
+		for (uint64_t i = 0; i < count; i++) {
+			if (p + 19 > data.size())
+				return false;
+			Record r;
+			r.isdir = data[p] != 0;
+			r.size = get(data, p + 1, 8);
+			r.mtime = (int64_t)get(data, p + 9, 8);
+			unsigned plen = get(data, p + 17, 2);
+			p += 19;
+			if (p + plen > data.size())
+				return false;
+			r.path = data.substr(p, plen);
+			p += plen;
+			records.push_back(std::move(r));
+		}
+		return p == data.size();
+	}
+
+private:
+	static void put(std::string &out, uint64_t v, unsigned bytes) {
+		for (unsigned i = 0; i < bytes; i++)
+			out.push_back((char)(v >> (i * 8)));
+	}
+
+	static uint64_t get(const std::string &in, size_t off, unsigned bytes) {
+		uint64_t v = 0;
+		for (unsigned i = 0; i < bytes; i++)
+			v |= ((uint64_t)(uint8_t)in[off + i]) << (i * 8);
+		return v;
+	}
+
+	// FNV-1a, good enough to tell index versions apart
+	static uint64_t hash(const char *data, size_t size) {
+		uint64_t h = 0xcbf29ce484222325ULL;
+		for (size_t i = 0; i < size; i++) {
+			h ^= (uint8_t)data[i];
+			h *= 0x100000001b3ULL;
+		}
+		return h;
+	}
+};
+
+#endif
@@ -4,6 +4,21 @@
 #include "fuseimpl.h"
 #include "httpfs.h"
 
+// Cache control attributes:
+//  setfattr -n user.httpfs.prefetch  -> load file (or subtree) into memory
+//  setfattr -n user.httpfs.pin       -> same, but never evict it
+//  setfattr -n user.httpfs.evict     -> drop it from the caches
+//  setfattr -x user.httpfs.pin       -> unpin, make it evictable again
+//  getfattr -n user.httpfs.cached    -> bytes in memory
+//  getfattr -n user.httpfs.pinned    -> pinned bytes in memory
+//  getfattr -n user.httpfs.status    -> files still being fetched and failed ones
+#define XATTR_PREFETCH   "user.httpfs.prefetch"
+#define XATTR_PIN        "user.httpfs.pin"
+#define XATTR_EVICT      "user.httpfs.evict"
+#define XATTR_CACHED     "user.httpfs.cached"
+#define XATTR_PINNED     "user.httpfs.pinned"
+#define XATTR_STATUS     "user.httpfs.status"
+
 std::pair<std::string, std::string> pathdecompose(std::string path) {
 	auto p = path.find_last_of('/');
 	if (p == std::string::npos)
@@ -11,12 +26,19 @@ std::pair<std::string, std::string> pathdecompose(std::string path) {
 	return std::make_pair(path.substr(0, p+1), path.substr(p+1));
 }
 
+static inline t_tracecache trace_cache(bool hit) {
+	return hit ? TRACE_HIT : TRACE_MISS;
+}
+
 int httpfs_open(const char *path, struct fuse_file_info *fi) {
-	return 0;   // TODO check it exists?
+	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+	TraceScope t(s->tracer.get(), fuse_get_context()->pid, TRACE_OPEN, path);
+	return t.done(0);   // TODO check it exists?
 }
 
 int httpfs_getattr(const char *path, struct stat *st) {
 	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+	TraceScope t(s->tracer.get(), fuse_get_context()->pid, TRACE_GETATTR, path);
 
 	if (!strcmp(path, "/")) {
 		memset(st, 0, sizeof(*st));
@@ -27,46 +49,52 @@ int httpfs_getattr(const char *path, struct stat *st) {
 		st->st_nlink = 1;
 		st->st_uid = getuid();
 		st->st_gid = getgid();
-		return 0;
+		return t.done(0);
 	}
 
 	auto dirfile = pathdecompose(path);
 
+	bool hit;
 	HttpFSServer::DirEntry entry;
-	if (!s->readDir(dirfile.first, entry))
-		return -EIO;
+	if (!s->readDir(dirfile.first, entry, &hit))
+		return t.done(-EIO, trace_cache(hit));
 
 	// Check file in entries
 	if (!entry.entries.count(dirfile.second))
-		return -ENOENT;
+		return t.done(-ENOENT, trace_cache(hit));
 
 	*st = entry.entries.at(dirfile.second);
-	return 0;
+	return t.done(0, trace_cache(hit));
 }
 
 int httpfs_read(const char *path, char *buf, size_t size,
                 off_t offset, struct fuse_file_info *fi) {
 	// Perform a GET query with partial content
 	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
-	int ret = s->readBlock(path, buf, offset, size);
+	TraceScope t(s->tracer.get(), fuse_get_context()->pid, TRACE_READ, path, offset, size);
+
+	bool hit;
+	int ret = s->readBlock(path, buf, offset, size, &hit);
 	if (ret < 0)
-		return -EIO;
-	return ret;
+		return t.done(-EIO, trace_cache(hit));
+	return t.done(ret, trace_cache(hit));
 }
 
 int httpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                    off_t offset, struct fuse_file_info *fi) {
 	// Perform GET query, and parse autoindex response
 	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+	TraceScope t(s->tracer.get(), fuse_get_context()->pid, TRACE_READDIR, path);
 
+	bool hit;
 	HttpFSServer::DirEntry entry;
-	if (!s->readDir(path, entry))
-		return -EIO;
+	if (!s->readDir(path, entry, &hit))
+		return t.done(-EIO, trace_cache(hit));
 
 	for (auto it : entry.entries)
 		filler(buf, it.first.c_str(), &it.second, 0);
 
-	return 0;
+	return t.done(0, trace_cache(hit));
 }
 
 int httpfs_write(const char *path, const char *buf, size_t size,
@@ -118,3 +146,65 @@ int httpfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 	return -EACCES;   // Only read-only support
 }
 
+
+int httpfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+
+	struct stat st;
+	int ret = httpfs_getattr(path, &st);
+	if (ret < 0)
+		return ret;
+
+	if (!strcmp(name, XATTR_PREFETCH))
+		return s->warmUp(path, st, false);
+	if (!strcmp(name, XATTR_PIN))
+		return s->warmUp(path, st, true);
+	if (!strcmp(name, XATTR_EVICT)) {
+		s->evict(path);
+		return 0;
+	}
+	return -ENOTSUP;
+}
+
+int httpfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+
+	std::string v;
+	if (!strcmp(name, XATTR_CACHED) || !strcmp(name, XATTR_PINNED)) {
+		uint64_t cached, pinned;
+		s->residency(path, cached, pinned);
+		v = std::to_string(strcmp(name, XATTR_CACHED) ? pinned : cached);
+	}
+	else if (!strcmp(name, XATTR_STATUS)) {
+		unsigned pending, failed;
+		s->warmStatus(path, pending, failed);
+		v = "pending=" + std::to_string(pending) + " failed=" + std::to_string(failed);
+	}
+	else
+		return -ENODATA;
+
+	if (!size)
+		return v.size();
+	if (size < v.size())
+		return -ERANGE;
+	memcpy(value, v.data(), v.size());
+	return v.size();
+}
+
+int httpfs_listxattr(const char *path, char *list, size_t size) {
+	static const char names[] = XATTR_CACHED "\0" XATTR_PINNED "\0" XATTR_STATUS "\0";
+	if (!size)
+		return sizeof(names) - 1;
+	if (size < sizeof(names) - 1)
+		return -ERANGE;
+	memcpy(list, names, sizeof(names) - 1);
+	return sizeof(names) - 1;
+}
+
+int httpfs_removexattr(const char *path, const char *name) {
+	HttpFSServer *s = ((HttpFSServer*)fuse_get_context()->private_data);
+	if (strcmp(name, XATTR_PIN))
+		return -ENOTSUP;
+	s->unpin(path);
+	return 0;
+}
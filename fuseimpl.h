@@ -17,4 +17,8 @@ int httpfs_chmod(const char *path, mode_t mode);
 int httpfs_chown(const char *path, uid_t uid, gid_t gid);
 int httpfs_truncate(const char *path, off_t offset);
 int httpfs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+int httpfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+int httpfs_getxattr(const char *path, const char *name, char *value, size_t size);
+int httpfs_listxattr(const char *path, char *list, size_t size);
+int httpfs_removexattr(const char *path, const char *name);
 
@@ -2,12 +2,15 @@
 // Implements a HTTPs client that works in async fashion.
 // It is able to perform requests and add requests on the fly.
 // Uses libcurl as backend.
+// Requests are scheduled by priority class, with per-class and global
+// limits on the number of requests in flight.
 
 #ifndef __HTTP_CLIENT_H__
 #define __HTTP_CLIENT_H__
 
 #include <memory>
 #include <map>
+#include <deque>
 #include <unordered_map>
 #include <mutex>
 #include <vector>
@@ -21,6 +24,15 @@
 
 #define CONNECT_TIMEOUT    30   // We will retry, but that sounds like a lot
 #define TRANSFER_TIMEOUT   60   // Abort after a minute, not even uploads are that slow
+#define MAX_INFLIGHT       16   // Default global limit of concurrent requests
+
+// Priority classes, lower value is scheduled first
+enum t_priority {
+	PRIO_READ = 0,        // Data reads an application is blocked on
+	PRIO_META = 1,        // Metadata lookups (also blocking, but cheaper)
+	PRIO_BACKGROUND = 2,  // Refreshes and prefetches nobody is waiting for
+	PRIO_COUNT
+};
 
 typedef size_t(*curl_write_function)(char *ptr, size_t size, size_t nmemb, void *userdata);
 
@@ -28,7 +40,7 @@ class HttpClient {
 private:
 	class t_query {
 	public:
-		t_query() : headers(NULL) {}
+		t_query() : headers(NULL), prio(PRIO_READ), bulk(false) {}
 		~t_query() {
 			if (headers)
 				curl_slist_free_all(headers);
@@ -36,12 +48,20 @@ private:
 		std::function<bool(std::string)> wrcb;  // Write callback (data download)
 		std::function<void(bool)>      donecb;  // End callback with result
 		struct curl_slist *headers;             // Any needed headers
+		t_priority prio;                        // Scheduling class
+		bool bulk;                              // No transfer timeout, only abort if stalled
 	};
 	// Client thread
 	std::thread worker;
-	// Queue of pending requests to be performed
-	std::map<CURL*, std::unique_ptr<t_query>> rqueue;
+	// Queues of pending requests to be performed (one per priority class)
+	std::deque<std::pair<CURL*, std::unique_ptr<t_query>>> rqueue[PRIO_COUNT];
 	mutable std::mutex rqueue_mutex;
+	// Scheduling limits (0 means no limit) and requests in flight per class
+	unsigned maxtotal, maxinflight[PRIO_COUNT], inflight[PRIO_COUNT];
+	// Receive rate limit per class (bytes/s, 0 means no limit), split evenly
+	// among the requests of the class in flight, rebalanced as they come and go
+	uint64_t maxrate[PRIO_COUNT];
+	bool rebalance;
 	// Multi handlers that is in charge of doing requests.
 	CURLM *multi_handle;
 	std::map<CURL*, std::unique_ptr<t_query>> request_set;
@@ -61,9 +81,14 @@ public:
 		unsigned connto = CONNECT_TIMEOUT,
 		unsigned tranfto = TRANSFER_TIMEOUT
 	)
-	: multi_handle(curl_multi_init()), end(false),
+	: maxtotal(MAX_INFLIGHT), rebalance(false), multi_handle(curl_multi_init()), end(false),
 	  proxy_addr(proxy_addr), connto(connto), tranfto(tranfto) {
 
+		for (unsigned i = 0; i < PRIO_COUNT; i++)
+			maxinflight[i] = inflight[i] = maxrate[i] = 0;
+		// Leave some room for foreground requests by default
+		maxinflight[PRIO_BACKGROUND] = MAX_INFLIGHT / 4;
+
 		// Create a new pipe, make both ends non-blocking
 		if (pipe(pipefd) < 0)
 			throw std::system_error();
@@ -99,16 +124,35 @@ public:
 			curl_multi_remove_handle(multi_handle, req.first);
 			curl_easy_cleanup(req.first);
 		}
-		for (const auto & req: rqueue) {
-			curl_multi_remove_handle(multi_handle, req.first);
-			curl_easy_cleanup(req.first);
+		for (unsigned i = 0; i < PRIO_COUNT; i++) {
+			for (const auto & req: rqueue[i])
+				curl_easy_cleanup(req.first);
 		}
 
 		// Wipe multi
 		curl_multi_cleanup(multi_handle);
 	}
 
-	std::pair<bool, std::string> get(const std::string &url, uint64_t offset, uint64_t maxsize) {
+	// Limits the number of requests in flight, globally or per class
+	void setMaxInflight(unsigned limit) {
+		std::lock_guard<std::mutex> guard(rqueue_mutex);
+		maxtotal = limit;
+	}
+
+	void setMaxInflight(t_priority prio, unsigned limit) {
+		std::lock_guard<std::mutex> guard(rqueue_mutex);
+		maxinflight[prio] = limit;
+	}
+
+	// Caps the aggregated download speed of a class (bytes/s). Changes only
+	// apply to requests in flight once some request starts or finishes.
+	void setRateLimit(t_priority prio, uint64_t rate) {
+		std::lock_guard<std::mutex> guard(rqueue_mutex);
+		maxrate[prio] = rate;
+	}
+
+	std::pair<bool, std::string> get(const std::string &url, uint64_t offset, uint64_t maxsize,
+		t_priority prio = PRIO_READ, bool bulk = false) {
 
 		// Use the async interface and block until ready
 		std::string response;
@@ -120,19 +164,23 @@ public:
 			},
 			[&p] (bool success) {
 				p.set_value(success);
-			});
+			}, prio, bulk);
 		return {p.get_future().get(), response};
 	}
 
 	void doGET(const std::string &url,
 		uint64_t offset, uint64_t maxsize,
 		std::function<bool(std::string)> wrcb = nullptr,
-		std::function<void(bool)> donecb = nullptr) {
+		std::function<void(bool)> donecb = nullptr,
+		t_priority prio = PRIO_READ,
+		bool bulk = false) {
 
 		CURL *req = curl_easy_init();
 		auto userq = std::make_unique<t_query>();
 		userq->wrcb = std::move(wrcb);
 		userq->donecb = std::move(donecb);
+		userq->prio = prio;
+		userq->bulk = bulk;
 		curl_easy_setopt(req, CURLOPT_FOLLOWLOCATION, 1);
 		curl_easy_setopt(req, CURLOPT_AUTOREFERER, 1L);
 		curl_easy_setopt(req, CURLOPT_MAXREDIRS, 5);
@@ -158,7 +206,14 @@ public:
 
 		curl_easy_setopt(req, CURLOPT_URL, url.c_str());
 		curl_easy_setopt(req, CURLOPT_CONNECTTIMEOUT, connto);
-		curl_easy_setopt(req, CURLOPT_TIMEOUT, tranfto);
+		if (userq->bulk) {
+			// Large downloads can take any time, as long as data keeps flowing
+			curl_easy_setopt(req, CURLOPT_TIMEOUT, 0L);
+			curl_easy_setopt(req, CURLOPT_LOW_SPEED_LIMIT, 1L);
+			curl_easy_setopt(req, CURLOPT_LOW_SPEED_TIME, (long)tranfto);
+		}
+		else
+			curl_easy_setopt(req, CURLOPT_TIMEOUT, tranfto);
 		curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, wrapperfn);
 		curl_easy_setopt(req, CURLOPT_WRITEDATA, userq.get());
 		if (!proxy_addr.empty())
@@ -170,8 +225,9 @@ public:
 
 		// Enqueues a query in the pending queue
 		{
+			t_priority prio = userq->prio;
 			std::lock_guard<std::mutex> guard(rqueue_mutex);
-			rqueue[req] = std::move(userq);
+			rqueue[prio].emplace_back(req, std::move(userq));
 		}
 
 		// Use self-pipe trick to make select return immediately
@@ -181,16 +237,36 @@ public:
 	// Will process http client requests
 	void work() {
 		while (!end) {
-			// Process input queue to add new requests
+			// Process input queues to add new requests, highest priority first
 			{
 				std::lock_guard<std::mutex> guard(rqueue_mutex);
-				for (auto & req: rqueue) {
-					// Add to the Multi client
-					curl_multi_add_handle(multi_handle, req.first);
-					// Add it to the req_set
-					request_set[req.first] = std::move(req.second);
+				for (unsigned p = 0; p < PRIO_COUNT; p++) {
+					while (!rqueue[p].empty() &&
+					       (!maxtotal || request_set.size() < maxtotal) &&
+					       (!maxinflight[p] || inflight[p] < maxinflight[p])) {
+						auto req = std::move(rqueue[p].front());
+						rqueue[p].pop_front();
+
+						// Add to the Multi client
+						curl_multi_add_handle(multi_handle, req.first);
+						// Add it to the req_set
+						request_set[req.first] = std::move(req.second);
+						inflight[p]++;
+						rebalance = true;
+					}
+				}
+
+				// Split the class bandwidth among its requests in flight
+				if (rebalance) {
+					for (const auto & req : request_set) {
+						t_priority p = req.second->prio;
+						if (maxrate[p]) {
+							curl_off_t rate = std::max<uint64_t>(maxrate[p] / inflight[p], 1);
+							curl_easy_setopt(req.first, CURLOPT_MAX_RECV_SPEED_LARGE, rate);
+						}
+					}
+					rebalance = false;
 				}
-				rqueue.clear();
 			}
 
 			// Work a bit, non blocking fashion
@@ -212,6 +288,11 @@ public:
 						const auto &uq = request_set.at(h);
 						if (uq->donecb)
 							uq->donecb(okcode);
+						{
+							std::lock_guard<std::mutex> guard(rqueue_mutex);
+							inflight[uq->prio]--;
+							rebalance = true;
+						}
 						request_set.erase(h);
 					}
 				}
@@ -223,6 +304,14 @@ public:
 				timeout.tv_sec = 10;
 				timeout.tv_usec = 0;
 
+				// Curl might need to wake up earlier (ie. rate limited transfers)
+				long curlto = -1;
+				curl_multi_timeout(multi_handle, &curlto);
+				if (curlto >= 0 && curlto < 10000) {
+					timeout.tv_sec = curlto / 1000;
+					timeout.tv_usec = (curlto % 1000) * 1000;
+				}
+
 				int maxfd;
 				fd_set rd, wr, er;
 				FD_ZERO(&rd); FD_ZERO(&wr); FD_ZERO(&er);
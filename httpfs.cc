@@ -1,8 +1,10 @@
 
 #include <nlohmann/json.hpp>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "httpfs.h"
+#include "fsindex.h"
 
 static const char *hcharset = "0123456789abcdef";
 static std::string urienc(std::string s) {
@@ -19,11 +21,32 @@ static std::string urienc(std::string s) {
 	return ret;
 }
 
-HttpFSServer::HttpFSServer(std::string url, unsigned metacachettl)
- : url(url), metacachettl(metacachettl), metacache(4*1024, 512)
+HttpFSServer::HttpFSServer(std::string url, unsigned metacachettl,
+                           std::string indexurl, unsigned indexrefresh)
+ : url(url), metacachettl(metacachettl), metacache(4*1024, 512),
+   stalettl(0), staleerrttl(0),
+   indexurl(indexurl), indexrefresh(indexrefresh), index_gen(0),
+   index_check(0), index_checking(false),
+   pf_maxsize(0), pf_budget(0), pf_bytes(0), pf_pinbudget(0), pf_pinned(0), pf_jobs(0)
 {
 }
 
+static struct stat make_stat(bool isdir, uint64_t size, time_t mtime) {
+	struct stat fst;
+	memset(&fst, 0, sizeof(fst));
+	fst.st_ino = 0;   // TODO: Needed if -o use_ino is used!?
+	fst.st_mode = S_IRUSR | S_IRGRP | (isdir ? S_IFDIR : S_IFREG);
+	fst.st_atime = mtime;
+	fst.st_mtime = mtime;
+	fst.st_ctime = mtime;
+	fst.st_nlink = 1;
+	fst.st_uid = getuid();
+	fst.st_gid = getgid();
+	if (!isdir)
+		fst.st_size = size;
+	return fst;
+}
+
 static HttpFSServer::DirEntry parse_response(nlohmann::json jresp) {
 	HttpFSServer::DirEntry entry;
 	entry.fetch_time = time(NULL);
@@ -34,66 +57,715 @@ static HttpFSServer::DirEntry parse_response(nlohmann::json jresp) {
 		strptime(jresp[i]["mtime"].get<std::string>().c_str(), "%a, %d %b %Y %H:%M:%S %Z", &pdate);
 		time_t mtime = mktime(&pdate);
 
-		struct stat fst;
-		memset(&fst, 0, sizeof(fst));
-		fst.st_ino = 0;   // TODO: Needed if -o use_ino is used!?
-		fst.st_mode = S_IRUSR | S_IRGRP | (isdir ? S_IFDIR : S_IFREG);
-		fst.st_atime = mtime;
-		fst.st_mtime = mtime;
-		fst.st_ctime = mtime;
-		fst.st_nlink = 1;
-		fst.st_uid = getuid();
-		fst.st_gid = getgid();
-		if (!isdir)
-			fst.st_size = jresp[i]["size"].get<uint64_t>();
-		entry.entries[fname] = fst;
+		uint64_t size = isdir ? 0 : jresp[i]["size"].get<uint64_t>();
+		entry.entries[fname] = make_stat(isdir, size, mtime);
 	}
 	return entry;
 }
 
-bool HttpFSServer::readDir(std::string path, DirEntry &entry) {
-	// Check the cache
-	if (metacache.tryGet(path, entry)) {
-		if (entry.fetch_time > time(NULL) - metacachettl) {
-			// Pre-fetch (async) any entry that is close to expire
-			if (entry.fetch_time < time(NULL) - metacachettl/2) {
-				auto jsresp = std::make_shared<std::string>();
-				readclient.doGET(url + urienc(path), 0, 0,
-					[jsresp] (std::string data) -> bool {
-						*jsresp += data;
-						return true;
-					},
-					[jsresp, path, this] (bool ok) {
-						auto js = nlohmann::json::parse(*jsresp, nullptr, false);
-						if (ok && !js.is_discarded())
-							metacache.insert(path, parse_response(js));
-					});
+// Listings are cached (and requested) with a trailing slash, whatever the caller used
+static std::string dirkey(std::string path) {
+	if (path.empty() || path.back() != '/')
+		path += '/';
+	return path;
+}
+
+// Whether some fetched file data still matches its directory listing
+static bool matches_listing(const std::string &data, time_t mtime,
+                            const HttpFSServer::DirEntry &entry, const std::string &fname) {
+	auto it = entry.entries.find(fname);
+	return it != entry.entries.end() && (uint64_t)it->second.st_size == data.size() &&
+	       it->second.st_mtime == mtime;
+}
+
+std::shared_ptr<HttpFSServer::IndexType> HttpFSServer::parseIndex(const std::string &data, uint64_t &generation) {
+	std::vector<FSIndex::Record> records;
+	if (!FSIndex::parse(data, generation, records))
+		return nullptr;
+
+	// Group records by parent directory (root being the empty path)
+	auto idx = std::make_shared<IndexType>();
+	time_t now = time(NULL);
+	(*idx)[""].fetch_time = now;
+	for (const auto & r : records) {
+		auto p = r.path.find_last_of('/');
+		if (p == std::string::npos)
+			continue;
+		auto & dentry = (*idx)[r.path.substr(0, p)];
+		dentry.fetch_time = now;
+		dentry.entries[r.path.substr(p+1)] = make_stat(r.isdir, r.size, r.mtime);
+	}
+	return idx;
+}
+
+bool HttpFSServer::loadIndex() {
+	auto ret = readclient.get(indexurl, 0, 0, PRIO_META, true);
+	if (!ret.first)
+		return false;
+
+	uint64_t gen;
+	auto idx = parseIndex(ret.second, gen);
+	if (!idx)
+		return false;
+
+	std::lock_guard<std::mutex> guard(index_mutex);
+	index = idx;
+	index_gen = gen;
+	index_check = time(NULL);
+	return true;
+}
+
+void HttpFSServer::refreshIndex() {
+	auto finish = [this] (std::shared_ptr<IndexType> idx, uint64_t gen) {
+		{
+			std::lock_guard<std::mutex> guard(index_mutex);
+			if (idx) {
+				index = idx;
+				index_gen = gen;
 			}
-			return true;    // Still cached, still valid
+			index_check = time(NULL);
+			index_checking = false;
 		}
-		else
-			metacache.remove(path);    // Entry has expired, re-fetch
+
+		// Drop file data that no longer matches the index
+		if (idx) {
+			std::lock_guard<std::mutex> guard(pf_mutex);
+			for (auto it = pf_data.begin(); it != pf_data.end(); ) {
+				auto cur = it++;
+				auto p = cur->first.find_last_of('/');
+				auto dir = idx->find(cur->first.substr(0, p));
+				if (dir == idx->end() || !matches_listing(cur->second.data, cur->second.mtime,
+				                                           dir->second, cur->first.substr(p+1)))
+					dropPrefetched(cur);
+			}
+		}
+	};
+
+	// Fetch the header only, download the full index just if it changed
+	auto hdr = std::make_shared<std::string>();
+	readclient.doGET(indexurl, 0, FSINDEX_HDR_SIZE,
+		[hdr] (std::string data) -> bool {
+			*hdr += data;
+			return true;
+		},
+		[hdr, finish, this] (bool ok) {
+			uint64_t gen, count;
+			if (!ok || !FSIndex::header(*hdr, gen, count))
+				return finish(nullptr, 0);
+			{
+				std::lock_guard<std::mutex> guard(index_mutex);
+				if (gen == index_gen)
+					return finish(nullptr, 0);    // Unchanged, nothing to do
+			}
+
+			auto data = std::make_shared<std::string>();
+			readclient.doGET(indexurl, 0, 0,
+				[data] (std::string chunk) -> bool {
+					*data += chunk;
+					return true;
+				},
+				[data, finish] (bool ok) {
+					uint64_t gen = 0;
+					finish(ok ? parseIndex(*data, gen) : nullptr, gen);
+				}, PRIO_BACKGROUND, true);
+		}, PRIO_BACKGROUND);
+}
+
+bool HttpFSServer::readIndexDir(std::string path, DirEntry &entry, bool *hit) {
+	while (!path.empty() && path.back() == '/')
+		path.pop_back();
+
+	std::shared_ptr<const IndexType> idx;
+	bool refresh = false;
+	{
+		std::lock_guard<std::mutex> guard(index_mutex);
+		idx = index;
+		if (indexrefresh && !index_checking && index_check <= time(NULL) - (time_t)indexrefresh)
+			refresh = index_checking = true;
 	}
+	if (refresh)
+		refreshIndex();
 
-	auto ret = readclient.get(url + urienc(path), 0, 0);
-	if (!ret.first)
+	if (!idx)
 		return false;
 
-	auto jresp = nlohmann::json::parse(ret.second, nullptr, false);
-	if (jresp.is_discarded())
+	if (hit)
+		*hit = true;
+
+	// Directories not in the index are empty (or do not exist at all)
+	auto it = idx->find(path);
+	if (it == idx->end()) {
+		entry.entries.clear();
+		entry.fetch_time = time(NULL);
+	}
+	else
+		entry = it->second;
+	return true;
+}
+
+bool HttpFSServer::readDir(std::string path, DirEntry &entry, bool *hit) {
+	if (hit)
+		*hit = false;
+
+	// Serve everything from the index when we have one
+	if (!indexurl.empty())
+		return readIndexDir(path, entry, hit);
+
+	path = dirkey(path);
+
+	// Check the cache
+	bool cached = metacache.tryGet(path, entry);
+	time_t age = cached ? time(NULL) - entry.fetch_time : 0;
+	bool stale_ok = cached && age < (time_t)(metacachettl + staleerrttl);
+	if (cached && age < (time_t)(metacachettl + stalettl)) {
+		// Pre-fetch (async) any entry that is close to expire (or already
+		// expired, but still within the stale-while-revalidate window)
+		if (age > (time_t)metacachettl/2)
+			refreshDir(path);
+		if (hit)
+			*hit = true;
+		return true;    // Still cached, still valid (or usable)
+	}
+
+	// Entry has expired (or was never there), re-fetch it. Serve the stale
+	// entry if we can while someone else is already asking the server.
+	if (stale_ok && isRefreshing(path)) {
+		if (hit)
+			*hit = true;
+		return true;
+	}
+
+	// Only one blocking request per directory goes to the server, others wait
+	// for it and use its result. Background refreshes can be throttled behind
+	// prefetches, so nobody blocks on those (we just issue our own request).
+	if (!beginFetch(path, false)) {
+		waitFetch(path);
+		DirEntry fresh;
+		if (metacache.tryGet(path, fresh) && fresh.fetch_time > time(NULL) - (time_t)metacachettl) {
+			entry = fresh;
+			return true;
+		}
+		if (!cached || entry.fetch_time <= time(NULL) - (time_t)(metacachettl + staleerrttl))
+			return false;    // It just failed, do not insist
+		if (hit)
+			*hit = true;
+		return true;
+	}
+
+	auto ret = readclient.get(url + urienc(path), 0, 0, PRIO_META);
+	auto jresp = nlohmann::json::parse(ret.first ? ret.second : "", nullptr, false);
+	if (!ret.first || jresp.is_discarded()) {
+		endFetch(path, false);
+		// Serve the stale entry if the server is having a hard time
+		if (stale_ok) {
+			if (hit)
+				*hit = true;
+			return true;
+		}
+		if (cached)
+			metacache.remove(path);
 		return false;
+	}
 
 	entry = parse_response(jresp);
 
 	// Cache fill
 	metacache.insert(path, entry);
+	endFetch(path, false);
+	validatePrefetched(path, entry);
+
+	if (pf_maxsize)
+		prefetchDir(path, entry);
+	return true;
+}
+
+void HttpFSServer::setStale(unsigned stalettl, unsigned staleerrttl) {
+	this->stalettl = stalettl;
+	this->staleerrttl = staleerrttl;
+}
+
+bool HttpFSServer::beginFetch(const std::string &path, bool background) {
+	std::lock_guard<std::mutex> guard(refresh_mutex);
+	return (background ? refreshing : fetching).insert(path).second;
+}
+
+void HttpFSServer::endFetch(const std::string &path, bool background) {
+	std::lock_guard<std::mutex> guard(refresh_mutex);
+	(background ? refreshing : fetching).erase(path);
+	if (!background)
+		refresh_cv.notify_all();
+}
+
+void HttpFSServer::waitFetch(const std::string &path) {
+	std::unique_lock<std::mutex> lock(refresh_mutex);
+	refresh_cv.wait(lock, [&] { return !fetching.count(path); });
+}
+
+bool HttpFSServer::isRefreshing(const std::string &path) {
+	std::lock_guard<std::mutex> guard(refresh_mutex);
+	return refreshing.count(path) || fetching.count(path);
+}
+
+void HttpFSServer::refreshDir(std::string path) {
+	// Only one refresh per directory at a time
+	if (!beginFetch(path, true))
+		return;
+
+	auto jsresp = std::make_shared<std::string>();
+	readclient.doGET(url + urienc(path), 0, 0,
+		[jsresp] (std::string data) -> bool {
+			*jsresp += data;
+			return true;
+		},
+		[jsresp, path, this] (bool ok) {
+			auto js = nlohmann::json::parse(*jsresp, nullptr, false);
+			if (ok && !js.is_discarded()) {
+				auto entry = parse_response(js);
+				metacache.insert(path, entry);
+				validatePrefetched(path, entry);
+			}
+			endFetch(path, true);
+		}, PRIO_BACKGROUND);
+}
+
+void HttpFSServer::setPrefetch(uint64_t maxsize, uint64_t budget, uint64_t pinbudget, unsigned jobs) {
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	pf_maxsize = maxsize;
+	pf_budget = budget;
+	pf_pinbudget = pinbudget;
+	pf_jobs = jobs ? jobs : 1;
+}
+
+// Whether a path falls under some file or directory (the path itself or a child)
+static bool under_path(const std::string &path, const std::string &prefix) {
+	if (path.compare(0, prefix.size(), prefix))
+		return false;
+	return path.size() == prefix.size() || prefix.back() == '/' || path[prefix.size()] == '/';
+}
+
+void HttpFSServer::prefetchDir(std::string path, const DirEntry &entry) {
+	path = dirkey(path);
+
+	{
+		std::lock_guard<std::mutex> guard(pf_mutex);
+		// Newer listings take precedence over whatever was still pending
+		pf_queue.remove_if([] (const PendingFile &f) { return !f.warm; });
+		for (const auto & it : entry.entries) {
+			const struct stat &st = it.second;
+			if (S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= pf_maxsize &&
+			    !pf_data.count(path + it.first) && !pf_fetching.count(path + it.first))
+				pf_queue.push_back({path + it.first, (uint64_t)st.st_size, st.st_mtime, false, false});
+		}
+	}
+	prefetchNext();
+}
+
+void HttpFSServer::prefetchNext() {
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	while (pf_fetching.size() < pf_jobs && !pf_queue.empty()) {
+		PendingFile pf = pf_queue.front();
+
+		// Already resident or on its way, just carry the pin over
+		if (pf_data.count(pf.path) || pf_fetching.count(pf.path)) {
+			pf_queue.pop_front();
+			if (pf.pin) {
+				pf_pinned -= pf.size;
+				setPinLocked(pf.path, true);
+			}
+			continue;
+		}
+
+		// Make room by evicting the oldest fetched files (pinned ones aren't accounted)
+		while (!pf.pin && pf_bytes + pf.size > pf_budget && !pf_order.empty())
+			dropPrefetched(pf_data.find(pf_order.front()));
+		if (!pf.pin && pf_bytes + pf.size > pf_budget) {
+			if (!pf_fetching.empty())
+				break;     // Inflight requests fill the budget, retry when they finish
+			pf_queue.pop_front();
+			if (pf.warm)
+				pf_failed.insert(pf.path);
+			continue;      // Does not fit at all
+		}
+
+		// Pinned files were accounted for when queued
+		pf_queue.pop_front();
+		if (!pf.pin)
+			pf_bytes += pf.size;
+
+		auto f = std::make_shared<Fetch>();
+		f->file = pf;
+		f->retries = 0;
+		f->cancelled = false;
+		f->data.reserve(pf.size);
+		pf_fetching[pf.path] = f;
+		fetchChunk(f);
+	}
+}
+
+void HttpFSServer::fetchChunk(std::shared_ptr<Fetch> f) {
+	uint64_t offset = f->data.size();
+	uint64_t size = std::min<uint64_t>(PREFETCH_CHUNK, f->file.size - offset);
+	auto chunk = std::make_shared<std::string>();
+	readclient.doGET(url + urienc(f->file.path), offset, size,
+		[chunk, size] (std::string data) -> bool {
+			*chunk += data;
+			return chunk->size() <= size;
+		},
+		[chunk, size, f, this] (bool ok) {
+			{
+				std::lock_guard<std::mutex> guard(pf_mutex);
+				if (!f->cancelled) {
+					if (ok && chunk->size() == size) {
+						f->data += *chunk;
+						f->retries = 0;
+						if (f->data.size() < f->file.size)
+							return fetchChunk(f);
+					}
+					else if (++f->retries < PREFETCH_RETRIES)
+						return fetchChunk(f);
+				}
+
+				// Cancelled fetches were already forgotten (and released) by evict
+				const PendingFile &pf = f->file;
+				if (!f->cancelled) {
+					pf_fetching.erase(pf.path);
+					if (f->data.size() == pf.size) {
+						pf_data[pf.path] = {std::move(f->data), pf.mtime, time(NULL), pf.pin};
+						if (!pf.pin)
+							pf_order.push_back(pf.path);
+					}
+					else {
+						if (pf.pin)
+							pf_pinned -= pf.size;
+						else
+							pf_bytes -= pf.size;
+						if (pf.warm)
+							pf_failed.insert(pf.path);
+					}
+				}
+			}
+			prefetchNext();
+		}, PRIO_BACKGROUND, true);
+}
+
+bool HttpFSServer::readPrefetched(const std::string &path, char *buf, uint64_t offset, uint64_t size,
+                                  int &ret, bool stale) {
+	// Stale data is only good as long as it matches the listing we still serve
+	DirEntry entry;
+	auto p = path.find_last_of('/');
+	if (stale && !cachedListing(path.substr(0, p+1), entry))
+		return false;
+
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	auto it = pf_data.find(path);
+	if (it == pf_data.end())
+		return false;
+
+	// Unpinned data is as trustworthy as the listing it came from, so it
+	// follows the same stale windows
+	if (!it->second.pinned) {
+		time_t age = time(NULL) - it->second.fetch_time;
+		if (age >= (time_t)(metacachettl + std::max(stalettl, staleerrttl))) {
+			dropPrefetched(it);
+			return false;
+		}
+		if (age >= (time_t)(metacachettl + (stale ? staleerrttl : stalettl)))
+			return false;
+	}
+	if (stale && !matches_listing(it->second.data, it->second.mtime, entry, path.substr(p+1)))
+		return false;
+
+	const std::string &data = it->second.data;
+	uint64_t avail = offset < data.size() ? std::min(size, data.size() - offset) : 0;
+	memcpy(buf, data.data() + offset, avail);
+	ret = avail;
+
+	// Drop it once it was read to the end, the kernel caches it from now on
+	// (unless the server is down, we might need it again)
+	if (!stale && !it->second.pinned && offset + avail >= data.size())
+		dropPrefetched(it);
 	return true;
 }
 
-int HttpFSServer::readBlock(std::string path, char *buf, uint64_t offset, uint64_t size) {
+bool HttpFSServer::cachedListing(const std::string &path, DirEntry &entry) {
+	if (!indexurl.empty()) {
+		std::string key = path.substr(0, path.size() - 1);
+		std::lock_guard<std::mutex> guard(index_mutex);
+		if (!index)
+			return false;
+		auto it = index->find(key);
+		if (it == index->end())
+			return false;
+		entry = it->second;
+		return true;
+	}
+
+	return metacache.tryGet(path, entry) &&
+	       entry.fetch_time > time(NULL) - (time_t)(metacachettl + staleerrttl);
+}
+
+void HttpFSServer::dropPrefetched(std::unordered_map<std::string, CachedFile>::iterator it) {
+	if (it->second.pinned)
+		pf_pinned -= it->second.data.size();
+	else {
+		pf_bytes -= it->second.data.size();
+		pf_order.remove(it->first);
+	}
+	pf_data.erase(it);
+}
+
+bool HttpFSServer::setPinLocked(const std::string &path, bool pin) {
+	auto it = pf_data.find(path);
+	if (it != pf_data.end()) {
+		if (it->second.pinned != pin) {
+			uint64_t size = it->second.data.size();
+			it->second.pinned = pin;
+			if (pin) {
+				pf_pinned += size;
+				pf_bytes -= size;
+				pf_order.remove(path);
+			}
+			else {
+				pf_pinned -= size;
+				pf_bytes += size;
+				pf_order.push_back(path);
+			}
+		}
+		return true;
+	}
+
+	auto fit = pf_fetching.find(path);
+	if (fit != pf_fetching.end()) {
+		PendingFile &pf = fit->second->file;
+		if (pf.pin != pin) {
+			pf.pin = pin;
+			if (pin) {
+				pf_pinned += pf.size;
+				pf_bytes -= pf.size;
+			}
+			else {
+				pf_pinned -= pf.size;
+				pf_bytes += pf.size;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+void HttpFSServer::validatePrefetched(std::string path, const DirEntry &entry) {
+	path = dirkey(path);
+
+	// Drop any data that does not match the (newer) listing
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	for (auto it = pf_data.begin(); it != pf_data.end(); ) {
+		auto cur = it++;
+		if (cur->first.compare(0, path.size(), path) ||
+		    cur->first.find('/', path.size()) != std::string::npos)
+			continue;    // Not in this directory
+
+		if (!matches_listing(cur->second.data, cur->second.mtime, entry, cur->first.substr(path.size())))
+			dropPrefetched(cur);
+		else
+			cur->second.fetch_time = std::max(cur->second.fetch_time, entry.fetch_time);
+	}
+}
+
+int HttpFSServer::warmUp(std::string path, const struct stat &st, bool pin) {
+	// Walk the subtree (filling the metadata cache) collecting all its files
+	std::vector<PendingFile> files;
+	if (S_ISDIR(st.st_mode)) {
+		std::vector<std::string> dirs = {dirkey(path)};
+		while (!dirs.empty()) {
+			std::string dpath = dirs.back();
+			dirs.pop_back();
+
+			DirEntry entry;
+			if (!readDir(dpath, entry))
+				return -EIO;
+			for (const auto & it : entry.entries) {
+				if (S_ISDIR(it.second.st_mode))
+					dirs.push_back(dirkey(dpath + it.first));
+				else if (it.second.st_size > 0)
+					files.push_back({dpath + it.first, (uint64_t)it.second.st_size, it.second.st_mtime, true, pin});
+			}
+		}
+	}
+	else if (st.st_size > 0)
+		files.push_back({path, (uint64_t)st.st_size, st.st_mtime, true, pin});
+
+	{
+		std::lock_guard<std::mutex> guard(pf_mutex);
+		std::unordered_map<std::string, std::list<PendingFile>::iterator> queued;
+		for (auto it = pf_queue.begin(); it != pf_queue.end(); it++)
+			queued[it->path] = it;
+
+		// Check whatever is not there (or not pinned) yet fits in memory
+		uint64_t needed = 0, largest = 0;
+		for (const auto & f : files) {
+			auto dit = pf_data.find(f.path);
+			auto fit = pf_fetching.find(f.path);
+			auto qit = queued.find(f.path);
+			bool present = (pin && dit != pf_data.end() && dit->second.pinned) ||
+			               (pin && fit != pf_fetching.end() && fit->second->file.pin) ||
+			               (pin && qit != queued.end() && qit->second->pin) ||
+			               (!pin && (dit != pf_data.end() || fit != pf_fetching.end()));
+			if (!present) {
+				needed += f.size;
+				largest = std::max(largest, f.size);
+			}
+		}
+		uint64_t budget = pin ? pf_pinbudget : pf_budget;
+		if (largest > budget)
+			return -EFBIG;
+		if ((pin ? pf_pinned : 0) + needed > budget)
+			return -ENOSPC;
+
+		// Queue them, or upgrade entries that are already queued/fetched
+		for (const auto & f : files) {
+			pf_failed.erase(f.path);
+			auto fit = pf_fetching.find(f.path);
+			if (fit != pf_fetching.end())
+				fit->second->file.warm = true;
+			if (pf_data.count(f.path) || fit != pf_fetching.end()) {
+				if (pin)
+					setPinLocked(f.path, true);
+				continue;
+			}
+
+			auto qit = queued.find(f.path);
+			if (qit != queued.end()) {
+				qit->second->warm = true;
+				if (pin && !qit->second->pin) {
+					qit->second->pin = true;
+					pf_pinned += f.size;
+				}
+			}
+			else {
+				pf_queue.push_back(f);
+				if (pin)
+					pf_pinned += f.size;
+			}
+		}
+	}
+	prefetchNext();
+	return 0;
+}
+
+void HttpFSServer::evict(std::string path) {
+	// Drop the cached listings of the whole subtree
+	std::vector<std::string> dirs = {dirkey(path)};
+	while (!dirs.empty()) {
+		std::string dpath = dirs.back();
+		dirs.pop_back();
+
+		DirEntry entry;
+		if (metacache.tryGet(dpath, entry)) {
+			for (const auto & it : entry.entries)
+				if (S_ISDIR(it.second.st_mode))
+					dirs.push_back(dirkey(dpath + it.first));
+			metacache.remove(dpath);
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	for (auto it = pf_queue.begin(); it != pf_queue.end(); ) {
+		if (under_path(it->path, path)) {
+			if (it->pin)
+				pf_pinned -= it->size;
+			it = pf_queue.erase(it);
+		}
+		else
+			it++;
+	}
+	for (auto it = pf_fetching.begin(); it != pf_fetching.end(); ) {
+		if (under_path(it->first, path)) {
+			// Let the request in flight run out, its data is discarded. It is
+			// forgotten right away though, so the file can be requested again.
+			const PendingFile &pf = it->second->file;
+			if (pf.pin)
+				pf_pinned -= pf.size;
+			else
+				pf_bytes -= pf.size;
+			it->second->cancelled = true;
+			it = pf_fetching.erase(it);
+		}
+		else
+			it++;
+	}
+	for (auto it = pf_data.begin(); it != pf_data.end(); ) {
+		auto cur = it++;
+		if (under_path(cur->first, path))
+			dropPrefetched(cur);
+	}
+	for (auto it = pf_failed.begin(); it != pf_failed.end(); ) {
+		if (under_path(*it, path))
+			it = pf_failed.erase(it);
+		else
+			it++;
+	}
+}
+
+void HttpFSServer::unpin(std::string path) {
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	for (auto & it : pf_queue) {
+		if (it.pin && under_path(it.path, path)) {
+			it.pin = false;
+			pf_pinned -= it.size;
+		}
+	}
+
+	std::vector<std::string> paths;
+	for (const auto & it : pf_data)
+		if (it.second.pinned && under_path(it.first, path))
+			paths.push_back(it.first);
+	for (const auto & it : pf_fetching)
+		if (it.second->file.pin && under_path(it.first, path))
+			paths.push_back(it.first);
+	for (const auto & p : paths)
+		setPinLocked(p, false);
+}
+
+void HttpFSServer::residency(std::string path, uint64_t &cached, uint64_t &pinned) {
+	cached = pinned = 0;
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	for (const auto & it : pf_data) {
+		if (under_path(it.first, path)) {
+			cached += it.second.data.size();
+			if (it.second.pinned)
+				pinned += it.second.data.size();
+		}
+	}
+}
+
+void HttpFSServer::warmStatus(std::string path, unsigned &pending, unsigned &failed) {
+	pending = failed = 0;
+	std::lock_guard<std::mutex> guard(pf_mutex);
+	for (const auto & it : pf_queue)
+		pending += (it.warm && under_path(it.path, path));
+	for (const auto & it : pf_fetching)
+		pending += (it.second->file.warm && under_path(it.first, path));
+	for (const auto & it : pf_failed)
+		failed += under_path(it, path);
+}
+
+int HttpFSServer::readBlock(std::string path, char *buf, uint64_t offset, uint64_t size, bool *hit) {
+	int pfret;
+	bool pfhit = readPrefetched(path, buf, offset, size, pfret, false);
+	if (hit)
+		*hit = pfhit;
+	if (pfhit)
+		return pfret;
+
 	auto ret = readclient.get(url + urienc(path), offset, size);
-	if (!ret.first || ret.second.size() > size)
-		return -1;
+	if (!ret.first || ret.second.size() > size) {
+		// Serve the prefetched copy (if any) if the server is having a hard time
+		if (!readPrefetched(path, buf, offset, size, pfret, true))
+			return -1;
+		if (hit)
+			*hit = true;
+		return pfret;
+	}
 
 	memcpy(buf, &ret.second[0], ret.second.size());
 	return ret.second.size();
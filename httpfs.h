@@ -1,13 +1,22 @@
 
 #include <nlohmann/json.hpp>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
 
 #include "lrucache.h"
 #include "httpclient.h"
+#include "trace.h"
+
+#define PREFETCH_CHUNK     (4*1024*1024)   // Files are fetched in chunks of this size
+#define PREFETCH_RETRIES   3               // Attempts per chunk before giving up
 
 class HttpFSServer {
 public:
-	HttpFSServer(std::string url, unsigned metacachettl);
+	HttpFSServer(std::string url, unsigned metacachettl,
+	             std::string indexurl = "", unsigned indexrefresh = 0);
 
 	class DirEntry {
 	public:
@@ -15,18 +24,101 @@ public:
 		time_t fetch_time;
 	};
 
-	HttpClient metaclient;     // For getattr/readdir-like operations
-	HttpClient readclient;     // For data transfer operations
+	HttpClient readclient;     // For all transfers, so they share scheduling limits
+	std::unique_ptr<Tracer> tracer;   // Records FUSE ops, if enabled
+
+	bool loadIndex();
+	void setPrefetch(uint64_t maxsize, uint64_t budget, uint64_t pinbudget, unsigned jobs);
+	void setStale(unsigned stalettl, unsigned staleerrttl);
+	// Both optionally report whether the request was served from memory
+	bool readDir(std::string path, DirEntry &entry, bool *hit = nullptr);
+	int readBlock(std::string path, char *buf, uint64_t offset, uint64_t size, bool *hit = nullptr);
 
-	bool readDir(std::string path, DirEntry &entry);
-	int readBlock(std::string path, char *buf, uint64_t offset, uint64_t size);
+	// Cache control: warm-up (and pinning) of a file or subtree, eviction and
+	// residency queries (bytes in memory, total and pinned, and number of
+	// files still being warmed up or that failed to)
+	int warmUp(std::string path, const struct stat &st, bool pin);
+	void evict(std::string path);
+	void unpin(std::string path);
+	void residency(std::string path, uint64_t &cached, uint64_t &pinned);
+	void warmStatus(std::string path, unsigned &pending, unsigned &failed);
 
 private:
+	class PendingFile {
+	public:
+		std::string path;
+		uint64_t size;
+		time_t mtime;
+		bool warm, pin;      // Explicit warm-up (and pinning) request
+	};
+	class CachedFile {
+	public:
+		std::string data;
+		time_t mtime, fetch_time;
+		bool pinned;
+	};
+	class Fetch {            // Inflight download, done in chunks
+	public:
+		PendingFile file;
+		std::string data;
+		unsigned retries;
+		bool cancelled;
+	};
+
 	typedef lru11::Cache<std::string, DirEntry, std::mutex> CacheType;
+	typedef std::unordered_map<std::string, DirEntry> IndexType;
+
+	static std::shared_ptr<IndexType> parseIndex(const std::string &data, uint64_t &generation);
+	bool readIndexDir(std::string path, DirEntry &entry, bool *hit);
+	void refreshIndex();
+	void refreshDir(std::string path);
+	bool beginFetch(const std::string &path, bool background);
+	void endFetch(const std::string &path, bool background);
+	void waitFetch(const std::string &path);
+	bool isRefreshing(const std::string &path);
+	void prefetchDir(std::string path, const DirEntry &entry);
+	void prefetchNext();
+	void fetchChunk(std::shared_ptr<Fetch> f);
+	bool setPinLocked(const std::string &path, bool pin);
+	bool readPrefetched(const std::string &path, char *buf, uint64_t offset, uint64_t size,
+	                    int &ret, bool stale);
+	bool cachedListing(const std::string &path, DirEntry &entry);
+	void validatePrefetched(std::string path, const DirEntry &entry);
+	void dropPrefetched(std::unordered_map<std::string, CachedFile>::iterator it);
 
 	const std::string url;
 	const unsigned metacachettl;
 	CacheType metacache;
+
+	// Expired listings are still served (while being refreshed) for stalettl
+	// seconds past the TTL, or staleerrttl seconds if the server fails to respond
+	unsigned stalettl, staleerrttl;
+	std::unordered_set<std::string> refreshing;    // Listings being refreshed (background)
+	std::unordered_set<std::string> fetching;      // Listings somebody is blocked on
+	std::mutex refresh_mutex;
+	std::condition_variable refresh_cv;
+
+	// Whole-tree index, replaces per-directory listings when in use
+	const std::string indexurl;
+	const unsigned indexrefresh;
+	std::shared_ptr<const IndexType> index;
+	uint64_t index_gen;
+	time_t index_check;
+	bool index_checking;
+	std::mutex index_mutex;
+
+	// File data prefetch (on listing or explicit warm-up). Prefetched files are
+	// kept until fully read (or metacachettl expires), pinned files until
+	// explicitly evicted or unpinned. Both are dropped if the listing changes.
+	uint64_t pf_maxsize, pf_budget, pf_bytes;      // Unpinned bytes (fetched and inflight)
+	uint64_t pf_pinbudget, pf_pinned;              // Pinned bytes (also queued ones)
+	unsigned pf_jobs;
+	std::list<PendingFile> pf_queue;                                   // Pending fetches
+	std::unordered_map<std::string, std::shared_ptr<Fetch>> pf_fetching; // Inflight
+	std::unordered_map<std::string, CachedFile> pf_data;               // Fetched files
+	std::unordered_set<std::string> pf_failed;                         // Failed warm-ups
+	std::list<std::string> pf_order;                                   // Fetch order, for eviction
+	std::mutex pf_mutex;
 };
 
 
@@ -19,6 +19,10 @@ static const struct fuse_operations operations = {
 	.open      = httpfs_open,
 	.read      = httpfs_read,
 	.write     = httpfs_write,
+	.setxattr  = httpfs_setxattr,
+	.getxattr  = httpfs_getxattr,
+	.listxattr = httpfs_listxattr,
+	.removexattr = httpfs_removexattr,
 	.readdir   = httpfs_readdir,
 	.create    = httpfs_create,
 };
@@ -26,6 +30,18 @@ static const struct fuse_operations operations = {
 static struct options {
 	const char *url;
 	int meta_cache_ttl;
+	int meta_stale_ttl;
+	int meta_stale_error_ttl;
+	const char *index_url;
+	int index_refresh;
+	int prefetch_size;
+	int prefetch_budget;
+	int prefetch_jobs;
+	int pin_budget;
+	int max_requests;
+	int max_background;
+	int background_rate;
+	const char *trace;
 	int show_help;
 } options;
 
@@ -33,6 +49,18 @@ static struct options {
 static const struct fuse_opt option_spec[] = {
 	OPTION("--url=%s", url),
 	OPTION("--meta-cache-ttl=%d", meta_cache_ttl),
+	OPTION("--meta-stale-ttl=%d", meta_stale_ttl),
+	OPTION("--meta-stale-error=%d", meta_stale_error_ttl),
+	OPTION("--index-url=%s", index_url),
+	OPTION("--index-refresh=%d", index_refresh),
+	OPTION("--prefetch-size=%d", prefetch_size),
+	OPTION("--prefetch-budget=%d", prefetch_budget),
+	OPTION("--prefetch-jobs=%d", prefetch_jobs),
+	OPTION("--pin-budget=%d", pin_budget),
+	OPTION("--max-requests=%d", max_requests),
+	OPTION("--max-background=%d", max_background),
+	OPTION("--background-rate=%d", background_rate),
+	OPTION("--trace=%s", trace),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
@@ -45,6 +73,18 @@ int main(int argc, char **argv) {
 	// Defaults
 	options.url = NULL;
 	options.meta_cache_ttl = 60;    // 1 minute is usually enough for most operations
+	options.meta_stale_ttl = 0;
+	options.meta_stale_error_ttl = 0;
+	options.index_url = NULL;
+	options.index_refresh = 300;    // Indices are meant for rarely changing trees
+	options.prefetch_size = 0;      // Disabled by default
+	options.prefetch_budget = 64;
+	options.prefetch_jobs = 4;
+	options.pin_budget = 1024;
+	options.max_requests = MAX_INFLIGHT;
+	options.max_background = MAX_INFLIGHT / 4;
+	options.background_rate = 0;    // No bandwidth limit
+	options.trace = NULL;
 	options.show_help = 0;
 
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) < 0)
@@ -55,6 +95,18 @@ int main(int argc, char **argv) {
 		printf("File-system specific options:\n"
 		       "    --url=<s>               URL of the HTTP(s) server\n"
 		       "    --meta-cache-ttl=<d>    Metadata cache TTL (seconds)\n"
+		       "    --meta-stale-ttl=<d>    Serve expired metadata while refreshing it (seconds)\n"
+		       "    --meta-stale-error=<d>  Serve expired metadata on server errors (seconds)\n"
+		       "    --index-url=<s>         URL of a whole-tree index (see mkindex)\n"
+		       "    --index-refresh=<d>     Index change check interval (seconds, 0 disables)\n"
+		       "    --prefetch-size=<d>     Prefetch files up to this size on listing (bytes, 0 disables)\n"
+		       "    --prefetch-budget=<d>   Memory used by prefetched, unpinned files (MiB)\n"
+		       "    --prefetch-jobs=<d>     Concurrent prefetch (and warm-up) requests\n"
+		       "    --pin-budget=<d>        Memory available for pinned files (MiB)\n"
+		       "    --max-requests=<d>      Max concurrent requests (0 means no limit)\n"
+		       "    --max-background=<d>    Max concurrent background requests (0 means no limit)\n"
+		       "    --background-rate=<d>   Total bandwidth cap for background requests (KiB/s)\n"
+		       "    --trace=<s>             Record a trace of all operations to a file\n"
 		       "\n");
 
 		fuse_opt_add_arg(&args, "--help");
@@ -66,10 +118,35 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	HttpFSServer *serv = new HttpFSServer(options.url, options.meta_cache_ttl);
+	HttpFSServer *serv = new HttpFSServer(options.url, options.meta_cache_ttl,
+		options.index_url ? options.index_url : "", options.index_refresh);
+
+	serv->readclient.setMaxInflight(options.max_requests);
+	serv->readclient.setMaxInflight(PRIO_BACKGROUND, options.max_background);
+	serv->readclient.setRateLimit(PRIO_BACKGROUND, (uint64_t)options.background_rate << 10);
+
+	serv->setStale(std::max(options.meta_stale_ttl, 0), std::max(options.meta_stale_error_ttl, 0));
+	serv->setPrefetch(std::max(options.prefetch_size, 0), (uint64_t)options.prefetch_budget << 20,
+	                  (uint64_t)std::max(options.pin_budget, 0) << 20, options.prefetch_jobs);
+
+	if (options.trace) {
+		FILE *fd = fopen(options.trace, "wb");
+		if (!fd) {
+			printf("Could not open trace file `%s`!\n", options.trace);
+			return 1;
+		}
+		serv->tracer.reset(new Tracer(fd));
+	}
+
+	if (options.index_url && !serv->loadIndex()) {
+		printf("Could not load the index from `%s`!\n", options.index_url);
+		return 1;
+	}
 
 	int ret = fuse_main(args.argc, args.argv, &operations, serv);
 	fuse_opt_free_args(&args);
+	if (serv->tracer)
+		serv->tracer->flush();
 	return ret;
 }
 
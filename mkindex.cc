@@ -0,0 +1,89 @@
+
+// Generates a whole-tree index file (see fsindex.h) out of a local directory.
+// Run it against the directory served over HTTP and publish the result
+// next to it, then mount using --index-url=
+
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "fsindex.h"
+
+// Directories being walked (device, inode), from the root down to the current one
+typedef std::set<std::pair<dev_t, ino_t>> t_dirset;
+
+static void walk(std::string root, std::string path, std::vector<FSIndex::Record> &records, t_dirset &parents) {
+	DIR *d = opendir((root + path).c_str());
+	if (!d) {
+		std::cerr << "Could not open directory " << root + path << std::endl;
+		return;
+	}
+
+	while (struct dirent *de = readdir(d)) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		std::string fpath = path + "/" + de->d_name;
+		struct stat st;
+		if (stat((root + fpath).c_str(), &st) < 0)
+			continue;
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+			continue;
+		if (fpath.size() > 0xFFFF)
+			continue;
+
+		// Symlinks are followed (as the web server does), but not into a loop
+		auto dirid = std::make_pair(st.st_dev, st.st_ino);
+		if (S_ISDIR(st.st_mode) && parents.count(dirid)) {
+			std::cerr << "Skipping directory loop at " << root + fpath << std::endl;
+			continue;
+		}
+
+		FSIndex::Record r;
+		r.path = fpath;
+		r.isdir = S_ISDIR(st.st_mode);
+		r.size = r.isdir ? 0 : st.st_size;
+		r.mtime = st.st_mtime;
+		records.push_back(r);
+
+		if (r.isdir) {
+			parents.insert(dirid);
+			walk(root, fpath, records, parents);
+			parents.erase(dirid);
+		}
+	}
+	closedir(d);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		std::cerr << "usage: " << argv[0] << " <root-directory> <index-file>" << std::endl;
+		return 1;
+	}
+
+	std::string root(argv[1]);
+	while (!root.empty() && root.back() == '/')
+		root.pop_back();
+
+	struct stat st;
+	if (stat(root.empty() ? "/" : root.c_str(), &st) < 0) {
+		std::cerr << "Could not open directory " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::vector<FSIndex::Record> records;
+	t_dirset parents = {std::make_pair(st.st_dev, st.st_ino)};
+	walk(root, "", records, parents);
+
+	std::ofstream ofd(argv[2], std::ios::binary);
+	ofd << FSIndex::serialize(records);
+	ofd.close();
+	if (!ofd) {
+		std::cerr << "Could not write index file " << argv[2] << std::endl;
+		return 1;
+	}
+
+	std::cout << "Wrote " << records.size() << " entries" << std::endl;
+	return 0;
+}
@@ -0,0 +1,214 @@
+
+// Replays a trace recorded with --trace= (see trace.h), either against a
+// mounted filesystem or directly against an HTTP server (using HttpFSServer
+// in-process). Each recorded thread is replayed in its own thread, at the
+// original pace (or faster/slower), and latency stats are printed at the end.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "httpfs.h"
+
+static const char *opnames[] = {"getattr", "readdir", "open", "read"};
+
+class OpStats {
+public:
+	std::vector<uint64_t> latencies;
+	unsigned hits = 0, errors = 0;
+};
+
+// Files stay open (per thread) from their first open/read until the replay ends,
+// like the traced application kept them, so reads do not pay for open/close
+typedef std::map<std::string, int> t_fdmap;
+
+static int mount_fd(const std::string &mnt, const std::string &path, t_fdmap &fds) {
+	auto it = fds.find(path);
+	if (it != fds.end())
+		return it->second;
+	int fd = open((mnt + path).c_str(), O_RDONLY);
+	if (fd >= 0)
+		fds[path] = fd;
+	return fd;
+}
+
+static int replay_mount(const std::string &mnt, const Tracer::Record &r, std::vector<char> &buf,
+                        t_fdmap &fds, std::chrono::steady_clock::time_point &start) {
+	std::string path = mnt + r.path;
+	switch (r.op) {
+	case TRACE_GETATTR: {
+		struct stat st;
+		return lstat(path.c_str(), &st) < 0 ? -errno : 0;
+	}
+	case TRACE_READDIR: {
+		DIR *d = opendir(path.c_str());
+		if (!d)
+			return -errno;
+		while (readdir(d));
+		closedir(d);
+		return 0;
+	}
+	case TRACE_OPEN: {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return -errno;
+		auto it = fds.find(r.path);
+		if (it != fds.end())
+			close(it->second);
+		fds[r.path] = fd;
+		return 0;
+	}
+	case TRACE_READ: {
+		// Files read without a recorded open are opened now, but that is not timed
+		int fd = mount_fd(mnt, r.path, fds);
+		if (fd < 0)
+			return -errno;
+		buf.resize(r.size);
+		start = std::chrono::steady_clock::now();
+		int ret = pread(fd, buf.data(), r.size, r.offset);
+		return ret < 0 ? -errno : ret;
+	}
+	};
+	return -EINVAL;
+}
+
+static int replay_direct(HttpFSServer *s, const Tracer::Record &r, std::vector<char> &buf, bool &hit) {
+	hit = false;
+	switch (r.op) {
+	case TRACE_GETATTR: {
+		if (r.path == "/")
+			return 0;
+		auto p = r.path.find_last_of('/');
+		HttpFSServer::DirEntry entry;
+		if (!s->readDir(r.path.substr(0, p+1), entry, &hit))
+			return -EIO;
+		return entry.entries.count(r.path.substr(p+1)) ? 0 : -ENOENT;
+	}
+	case TRACE_READDIR: {
+		HttpFSServer::DirEntry entry;
+		return s->readDir(r.path, entry, &hit) ? 0 : -EIO;
+	}
+	case TRACE_OPEN:
+		return 0;
+	case TRACE_READ: {
+		buf.resize(r.size);
+		int ret = s->readBlock(r.path, buf.data(), r.offset, r.size, &hit);
+		return ret < 0 ? -EIO : ret;
+	}
+	};
+	return -EINVAL;
+}
+
+static void print_stats(const char *title, std::map<unsigned, OpStats> &stats) {
+	std::cout << title << std::endl;
+	for (auto & it : stats) {
+		auto &lat = it.second.latencies;
+		std::sort(lat.begin(), lat.end());
+		uint64_t total = 0;
+		for (auto l : lat)
+			total += l;
+		std::cout << "  " << opnames[it.first] << ": " << lat.size() << " ops, "
+		          << it.second.hits << " hits, " << it.second.errors << " errors, "
+		          << "avg " << total / lat.size() / 1000 << "us, "
+		          << "p50 " << lat[lat.size() / 2] / 1000 << "us, "
+		          << "p99 " << lat[lat.size() * 99 / 100] / 1000 << "us" << std::endl;
+	}
+}
+
+int main(int argc, char **argv) {
+	double speed = 1.0;
+	int prefetch_size = 0, metattl = 60;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:t:")) != -1) {
+		switch (opt) {
+		case 's': speed = atof(optarg); break;
+		case 'p': prefetch_size = atoi(optarg); break;
+		case 't': metattl = atoi(optarg); break;
+		default: optind = argc; break;
+		};
+	}
+	if (argc - optind != 2) {
+		std::cerr << "usage: " << argv[0] << " [options] <trace-file> <mountpoint|url>\n\n"
+		          << "    -s <f>    Replay speed factor (1 original pace, 0 as fast as possible)\n"
+		          << "    -p <d>    Small file prefetch size (direct mode only)\n"
+		          << "    -t <d>    Metadata cache TTL (direct mode only)\n";
+		return 1;
+	}
+
+	std::ifstream ifd(argv[optind], std::ios::binary);
+	std::stringstream ss;
+	ss << ifd.rdbuf();
+
+	int64_t walltime;
+	std::vector<Tracer::Record> records;
+	if (!Tracer::parse(ss.str(), walltime, records)) {
+		std::cerr << "Could not parse trace file " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	// Replay directly using an HttpFSServer when given a URL
+	std::string target(argv[optind + 1]);
+	std::unique_ptr<HttpFSServer> serv;
+	if (target.compare(0, 7, "http://") == 0 || target.compare(0, 8, "https://") == 0) {
+		serv.reset(new HttpFSServer(target, metattl));
+		serv->setPrefetch(prefetch_size, 64 << 20, 0, 4);
+	}
+
+	// Split the trace by thread, replay each one in its own thread
+	std::map<uint32_t, std::vector<const Tracer::Record*>> threads;
+	std::map<unsigned, OpStats> recorded;
+	uint64_t tstart = UINT64_MAX;
+	for (const auto & r : records) {
+		if (r.op > TRACE_READ)
+			continue;
+		tstart = std::min(tstart, r.start);
+		threads[r.thread].push_back(&r);
+		recorded[r.op].latencies.push_back(r.latency);
+		recorded[r.op].hits += (r.cache == TRACE_HIT);
+		recorded[r.op].errors += (r.result < 0);
+	}
+
+	std::mutex stats_mutex;
+	std::map<unsigned, OpStats> replayed;
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (const auto & th : threads) {
+		workers.emplace_back([&, th] () {
+			std::vector<char> buf;
+			t_fdmap fds;
+			for (const auto r : th.second) {
+				// Timestamps are relative to the first recorded op (not the mount time)
+				if (speed > 0)
+					std::this_thread::sleep_until(t0 + std::chrono::nanoseconds((uint64_t)((r->start - tstart) / speed)));
+
+				bool hit = false;
+				auto start = std::chrono::steady_clock::now();
+				int ret = serv ? replay_direct(serv.get(), *r, buf, hit) : replay_mount(target, *r, buf, fds, start);
+				uint64_t lat = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count();
+
+				std::lock_guard<std::mutex> guard(stats_mutex);
+				replayed[r->op].latencies.push_back(lat);
+				replayed[r->op].hits += hit;
+				replayed[r->op].errors += (ret < 0);
+			}
+			for (const auto & it : fds)
+				close(it.second);
+		});
+	}
+	for (auto & w : workers)
+		w.join();
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	std::cout << "Replayed " << records.size() << " ops from " << threads.size()
+	          << " threads in " << elapsed << "s" << std::endl;
+	print_stats("Recorded:", recorded);
+	print_stats("Replayed:", replayed);
+	return 0;
+}
@@ -0,0 +1,181 @@
+
+// Binary trace of FUSE operations, used to capture real workloads and
+// replay them later (see replay.cc).
+//
+// Layout (all integers are little endian):
+//   header:  "HFSTRAC1" magic, i64 wall-clock start time (seconds)
+//   records: u8 op, u8 cache outcome, u32 thread, u64 start (ns since the
+//            trace started), u64 latency (ns), u64 offset, u32 size,
+//            i32 result, u16 path length, path bytes
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+#define TRACE_MAGIC      "HFSTRAC1"
+#define TRACE_HDR_SIZE   16
+#define TRACE_REC_SIZE   40
+#define TRACE_FLUSH      (64*1024)
+
+enum t_traceop {
+	TRACE_GETATTR = 0,
+	TRACE_READDIR = 1,
+	TRACE_OPEN = 2,
+	TRACE_READ = 3,
+};
+
+enum t_tracecache {
+	TRACE_MISS = 0,
+	TRACE_HIT = 1,
+	TRACE_NONE = 2,    // No cache involved
+};
+
+class Tracer {
+public:
+	class Record {
+	public:
+		t_traceop op;
+		t_tracecache cache;
+		uint32_t thread;
+		uint64_t start, latency;
+		uint64_t offset;
+		uint32_t size;
+		int32_t result;
+		std::string path;
+	};
+
+	Tracer(FILE *fd) : fd(fd), t0(std::chrono::steady_clock::now()) {
+		std::string hdr(TRACE_MAGIC);
+		put(hdr, time(NULL), 8);
+		fwrite(hdr.data(), 1, hdr.size(), fd);
+	}
+
+	~Tracer() {
+		flush();
+		fclose(fd);
+	}
+
+	// Nanoseconds since the trace started
+	uint64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - t0).count();
+	}
+
+	void log(const Record &r) {
+		std::string rec;
+		rec.push_back(r.op);
+		rec.push_back(r.cache);
+		put(rec, r.thread, 4);
+		put(rec, r.start, 8);
+		put(rec, r.latency, 8);
+		put(rec, r.offset, 8);
+		put(rec, r.size, 4);
+		put(rec, (uint32_t)r.result, 4);
+		put(rec, r.path.size(), 2);
+		rec += r.path;
+
+		std::lock_guard<std::mutex> guard(mu);
+		buffer += rec;
+		if (buffer.size() >= TRACE_FLUSH)
+			flushLocked();
+	}
+
+	void flush() {
+		std::lock_guard<std::mutex> guard(mu);
+		flushLocked();
+	}
+
+	// Parses a whole trace, returns false if it is not a valid trace
+	static bool parse(const std::string &data, int64_t &walltime, std::vector<Record> &records) {
+		if (data.size() < TRACE_HDR_SIZE || memcmp(data.data(), TRACE_MAGIC, 8))
+			return false;
+		walltime = get(data, 8, 8);
+
+		size_t p = TRACE_HDR_SIZE;
+		while (p + TRACE_REC_SIZE <= data.size()) {
+			Record r;
+			r.op = (t_traceop)data[p];
+			r.cache = (t_tracecache)data[p + 1];
+			r.thread = get(data, p + 2, 4);
+			r.start = get(data, p + 6, 8);
+			r.latency = get(data, p + 14, 8);
+			r.offset = get(data, p + 22, 8);
+			r.size = get(data, p + 30, 4);
+			r.result = (int32_t)get(data, p + 34, 4);
+			unsigned plen = get(data, p + 38, 2);
+			p += TRACE_REC_SIZE;
+			if (p + plen > data.size())
+				break;     // Truncated at the end, keep what we have
+			r.path = data.substr(p, plen);
+			p += plen;
+			records.push_back(std::move(r));
+		}
+		return true;
+	}
+
+private:
+	void flushLocked() {
+		fwrite(buffer.data(), 1, buffer.size(), fd);
+		fflush(fd);
+		buffer.clear();
+	}
+
+	static void put(std::string &out, uint64_t v, unsigned bytes) {
+		for (unsigned i = 0; i < bytes; i++)
+			out.push_back((char)(v >> (i * 8)));
+	}
+
+	static uint64_t get(const std::string &in, size_t off, unsigned bytes) {
+		uint64_t v = 0;
+		for (unsigned i = 0; i < bytes; i++)
+			v |= ((uint64_t)(uint8_t)in[off + i]) << (i * 8);
+		return v;
+	}
+
+	FILE *fd;
+	std::chrono::steady_clock::time_point t0;
+	std::mutex mu;
+	std::string buffer;
+};
+
+// Traces one operation, from construction until done() is called.
+// Does nothing if there is no tracer.
+class TraceScope {
+public:
+	TraceScope(Tracer *tracer, uint32_t thread, t_traceop op, const char *path,
+	           uint64_t offset = 0, uint32_t size = 0)
+	 : tracer(tracer) {
+		if (tracer) {
+			rec.op = op;
+			rec.thread = thread;
+			rec.path = path;
+			rec.offset = offset;
+			rec.size = size;
+			rec.start = tracer->now();
+		}
+	}
+
+	int done(int result, t_tracecache cache = TRACE_NONE) {
+		if (tracer) {
+			rec.latency = tracer->now() - rec.start;
+			rec.result = result;
+			rec.cache = cache;
+			tracer->log(rec);
+		}
+		return result;
+	}
+
+private:
+	Tracer *tracer;
+	Tracer::Record rec;
+};
+
+#endif